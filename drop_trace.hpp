@@ -0,0 +1,499 @@
+#pragma once
+#include <juce_core/juce_core.h>
+#include <array>
+#include <atomic>
+#include "drops_v2.hpp"
+
+// Binary trace of every drop the engine schedules, so a render can be replayed
+// without touching the random number generators.
+//
+// Layout (little endian, JUCE stream encoding):
+//   header : "RDTR" | int16 version | int16 reserved | double sample rate | int32 slot count
+//            | int32 noise seed | float running max
+//   record : uint8 type | compressed int sample delta | compressed int slot
+//            | float t_init, delta_t_1, delta_t_2, delta_t_3, m, f, A0, A1 | int8 pan
+//            | float time (snapshot records only)
+//   switch : uint8 Switch | compressed int sample delta | compressed int fade length
+//            | compressed int fade position
+//   footer : uint8 End | int32 number of records lost because the writer fell behind
+//
+// A record's sample is the number of samples rendered before its slot is armed:
+// the pool captured when recording starts sits at sample 0, and a drop reset
+// after rendering sample n sits at n + 1.
+//
+// A switch record marks the engine crossfading to another voice pool: the pool
+// playing so far starts fading out and a silent pool takes its place, armed by
+// the snapshot records that follow at the same sample. The header's slot count
+// is the largest pool either side can hold.
+
+static constexpr char dropTraceMagic[4] = {'R', 'D', 'T', 'R'};
+static constexpr int dropTraceVersion = 1;
+// well above the largest voice pool, a header asking for more is corrupt
+static constexpr int dropTraceMaxSlots = 1024;
+
+struct DropTraceHeader
+{
+    double sampleRate = 44100.0; // host rate while recording, also the drops' clock
+    int slotCount = 0;
+    juce::uint32 noiseSeed = 0;
+    float runningMax = -20.f;
+};
+
+struct DropEvent
+{
+    enum Type : juce::uint8
+    {
+        Reset = 0,    // slot restarts at time 0
+        Snapshot = 1, // slot state captured mid-flight, carries its time
+        Switch = 2,   // crossfade to a fresh pool
+        End = 0xff
+    };
+
+    juce::uint8 type = Reset;
+    juce::int64 sample = 0;
+    int slot = 0;
+    float t_init = 0.f, delta_t_1 = 0.f, delta_t_2 = 0.f, delta_t_3 = 0.f;
+    float m = 0.f, f = 0.f;
+    float A0 = 0.f, A1 = 0.f;
+    juce::int8 pan = 0; // -127 left to 127 right, the engine is mono so always centre
+    float time = 0.f;
+    int fadeLength = 0, fadePosition = 0; // switch records only
+
+    static DropEvent capture(juce::uint8 eventType, juce::int64 eventSample, int eventSlot, const Drop_v2 &drop)
+    {
+        DropEvent event;
+        event.type = eventType;
+        event.sample = eventSample;
+        event.slot = eventSlot;
+        event.t_init = drop.t_init;
+        event.delta_t_1 = drop.delta_t_1;
+        event.delta_t_2 = drop.delta_t_2;
+        event.delta_t_3 = drop.delta_t_3;
+        event.m = drop.m;
+        event.f = drop.f;
+        event.A0 = drop.A0;
+        event.A1 = drop.A1;
+        event.time = eventType == Snapshot ? drop.time : 0.f;
+        return event;
+    }
+
+    static DropEvent crossfade(juce::int64 eventSample, int length, int position)
+    {
+        DropEvent event;
+        event.type = Switch;
+        event.sample = eventSample;
+        event.fadeLength = length;
+        event.fadePosition = position;
+        return event;
+    }
+
+    void apply(Drop_v2 &drop) const
+    {
+        drop.t_init = t_init;
+        drop.delta_t_1 = delta_t_1;
+        drop.delta_t_2 = delta_t_2;
+        drop.delta_t_3 = delta_t_3;
+        drop.m = m;
+        drop.f = f;
+        drop.A0 = A0;
+        drop.A1 = A1;
+        drop.time = time;
+    }
+
+    void write(juce::OutputStream &out, juce::int64 previousSample) const
+    {
+        out.writeByte((char)type);
+        out.writeCompressedInt((int)(sample - previousSample));
+        if (type == Switch)
+        {
+            out.writeCompressedInt(fadeLength);
+            out.writeCompressedInt(fadePosition);
+            return;
+        }
+        out.writeCompressedInt(slot);
+        out.writeFloat(t_init);
+        out.writeFloat(delta_t_1);
+        out.writeFloat(delta_t_2);
+        out.writeFloat(delta_t_3);
+        out.writeFloat(m);
+        out.writeFloat(f);
+        out.writeFloat(A0);
+        out.writeFloat(A1);
+        out.writeByte((char)pan);
+        if (type == Snapshot)
+            out.writeFloat(time);
+    }
+
+    bool read(juce::InputStream &in, juce::int64 previousSample)
+    {
+        if (in.getNumBytesRemaining() < 1)
+            return false;
+
+        type = (juce::uint8)in.readByte();
+        if (type != Reset && type != Snapshot && type != Switch)
+            return false;
+
+        sample = previousSample + in.readCompressedInt();
+        if (type == Switch)
+        {
+            fadeLength = in.readCompressedInt();
+            fadePosition = in.readCompressedInt();
+            return fadeLength > 0 && juce::isPositiveAndBelow(fadePosition, fadeLength);
+        }
+
+        slot = in.readCompressedInt();
+        if (slot < 0)
+            return false;
+
+        // eight floats and the pan, plus the time on snapshots
+        if (in.getNumBytesRemaining() < 8 * 4 + 1 + (type == Snapshot ? 4 : 0))
+            return false;
+
+        t_init = in.readFloat();
+        delta_t_1 = in.readFloat();
+        delta_t_2 = in.readFloat();
+        delta_t_3 = in.readFloat();
+        m = in.readFloat();
+        f = in.readFloat();
+        A0 = in.readFloat();
+        A1 = in.readFloat();
+        pan = (juce::int8)in.readByte();
+        time = type == Snapshot ? in.readFloat() : 0.f;
+        return true;
+    }
+};
+
+// Records drop events to disk. push() is called from the audio thread and only
+// touches a fixed size fifo; a background thread drains it into the file.
+class DropTraceWriter : private juce::Thread
+{
+public:
+    explicit DropTraceWriter(const juce::File &file) : juce::Thread("Drop trace writer")
+    {
+        stream = std::make_unique<juce::FileOutputStream>(file);
+        if (!stream->openedOk())
+        {
+            stream.reset();
+            return;
+        }
+        stream->setPosition(0);
+        stream->truncate();
+    }
+
+    ~DropTraceWriter() override
+    {
+        stopThread(1000);
+        if (stream == nullptr)
+            return;
+
+        drain();
+        stream->writeByte((char)DropEvent::End);
+        stream->writeInt(dropped.load());
+        stream->flush();
+    }
+
+    bool openedOk() const
+    {
+        return stream != nullptr;
+    }
+
+    // writes the header and starts draining, events pushed before this are kept
+    void start(const DropTraceHeader &header)
+    {
+        jassert(stream != nullptr);
+        stream->write(dropTraceMagic, sizeof(dropTraceMagic));
+        stream->writeShort((short)dropTraceVersion);
+        stream->writeShort(0);
+        stream->writeDouble(header.sampleRate);
+        stream->writeInt(header.slotCount);
+        stream->writeInt((int)header.noiseSeed);
+        stream->writeFloat(header.runningMax);
+        startThread();
+    }
+
+    // never allocates or blocks, a full fifo loses the event and counts it
+    bool push(const DropEvent &event)
+    {
+        auto write = fifo.write(1);
+        if (write.blockSize1 > 0)
+        {
+            events[write.startIndex1] = event;
+            return true;
+        }
+
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+private:
+    // a second of the densest rain takes well under a tenth of this
+    static constexpr int Capacity = 8192;
+    std::array<DropEvent, Capacity> events;
+    juce::AbstractFifo fifo{Capacity};
+    std::unique_ptr<juce::FileOutputStream> stream;
+    juce::int64 lastSample = 0;
+    std::atomic<int> dropped{0};
+
+    void run() override
+    {
+        while (!threadShouldExit())
+        {
+            drain();
+            wait(50);
+        }
+    }
+
+    void drain()
+    {
+        auto read = fifo.read(fifo.getNumReady());
+        for (int i = 0; i < read.blockSize1; ++i)
+            writeEvent(events[read.startIndex1 + i]);
+        for (int i = 0; i < read.blockSize2; ++i)
+            writeEvent(events[read.startIndex2 + i]);
+    }
+
+    void writeEvent(const DropEvent &event)
+    {
+        event.write(*stream, lastSample);
+        lastSample = event.sample;
+    }
+};
+
+// Reads a trace straight out of a memory mapped file.
+class DropTraceReader
+{
+public:
+    explicit DropTraceReader(const juce::File &file)
+        : map(file, juce::MemoryMappedFile::readOnly)
+    {
+        if (map.getData() == nullptr)
+            return;
+
+        stream = std::make_unique<juce::MemoryInputStream>(map.getData(), map.getSize(), false);
+
+        char magic[4];
+        if (stream->read(magic, sizeof(magic)) != (int)sizeof(magic) || memcmp(magic, dropTraceMagic, sizeof(magic)) != 0 || stream->readShort() != dropTraceVersion)
+        {
+            stream.reset();
+            return;
+        }
+        stream->readShort();
+        header.sampleRate = stream->readDouble();
+        header.slotCount = stream->readInt();
+        header.noiseSeed = (juce::uint32)stream->readInt();
+        header.runningMax = stream->readFloat();
+
+        if (stream->isExhausted() || !(header.sampleRate > 0.0 && header.sampleRate <= 1.0e6) || !juce::isPositiveAndNotGreaterThan(header.slotCount, dropTraceMaxSlots))
+        {
+            stream.reset();
+            return;
+        }
+        scanForFooter();
+    }
+
+    bool openedOk() const
+    {
+        return stream != nullptr;
+    }
+
+    const DropTraceHeader &getHeader() const
+    {
+        return header;
+    }
+
+    // false when the recording never got to write its footer, e.g. after a crash
+    bool isComplete() const
+    {
+        return complete;
+    }
+
+    // records the writer lost because its fifo was full
+    int getNumLost() const
+    {
+        return numLost;
+    }
+
+    // false once the footer, a truncated record or the end of the file is reached
+    bool next(DropEvent &event)
+    {
+        if (stream == nullptr)
+            return false;
+
+        if (!event.read(*stream, lastSample))
+        {
+            stream.reset();
+            return false;
+        }
+        lastSample = event.sample;
+        return true;
+    }
+
+private:
+    juce::MemoryMappedFile map;
+    std::unique_ptr<juce::MemoryInputStream> stream;
+    DropTraceHeader header;
+    juce::int64 lastSample = 0;
+    bool complete = false;
+    int numLost = 0;
+
+    // walks the records once up front, so a trace is known to be whole before replay
+    void scanForFooter()
+    {
+        auto start = stream->getPosition();
+        DropEvent event;
+        juce::int64 previous = 0;
+        while (event.read(*stream, previous))
+            previous = event.sample;
+
+        if (event.type == DropEvent::End && stream->getNumBytesRemaining() >= 4)
+        {
+            complete = true;
+            numLost = stream->readInt();
+        }
+        stream->setPosition(start);
+    }
+};
+
+// Re-renders a trace without any scheduling or random number work. Rendering at
+// the trace's own sample rate reproduces the recorded drops bit for bit; any other
+// rate renders the same events at that quality tier.
+class DropTraceReplay
+{
+public:
+    DropTraceReplay(const juce::File &file, double renderRate = 0.0) : reader(file)
+    {
+        opened = reader.openedOk();
+        if (!opened)
+            return;
+
+        auto traceRate = reader.getHeader().sampleRate;
+        rateRatio = renderRate > 0.0 ? renderRate / traceRate : 1.0;
+        // same expression as the live engine, so the native rate steps identically
+        auto dt = (float)(1.0 / (traceRate * rateRatio));
+
+        // both pools are sized up front so switches never allocate
+        for (auto &pool : pools)
+        {
+            pool.drops.resize(reader.getHeader().slotCount);
+            pool.num_drops = reader.getHeader().slotCount;
+            for (auto &drop : pool.drops)
+                drop.dt = dt;
+            silence(pool);
+        }
+        hasPending = reader.next(pending);
+    }
+
+    bool openedOk() const
+    {
+        return opened;
+    }
+
+    const DropTraceHeader &getHeader() const
+    {
+        return reader.getHeader();
+    }
+
+    // only a complete trace with no lost records replays exactly
+    bool isExact() const
+    {
+        return reader.isComplete() && reader.getNumLost() == 0;
+    }
+
+    // true once every event has been armed and every drop has rung out; checked
+    // by the audio thread once per block, read by the editor
+    bool isDone() const
+    {
+        return done.load();
+    }
+
+    void updateDone()
+    {
+        if (hasPending || fading != nullptr || done.load())
+            return;
+        for (int k = 0; k < active->used; ++k)
+            if (active->drops.drops[k].time < active->drops.drops[k].t_init + active->drops.drops[k].delta_t_3)
+                return;
+        done.store(true);
+    }
+
+    // one sample of the replayed drops, crossfading the same way PresetMorph
+    // does; only slots the trace has armed are rendered, so a small recorded
+    // pool stays cheap whatever the header allows
+    float operator()()
+    {
+        while (hasPending && scaled(pending.sample) <= position)
+        {
+            if (pending.type == DropEvent::Switch)
+            {
+                beginFade(pending);
+            }
+            else if (juce::isPositiveAndBelow(pending.slot, (int)active->drops.drops.size()))
+            {
+                pending.apply(active->drops.drops[pending.slot]);
+                active->used = juce::jmax(active->used, pending.slot + 1);
+            }
+            hasPending = reader.next(pending);
+        }
+        ++position;
+
+        float res = active->render();
+        if (fading == nullptr)
+            return res;
+
+        res = mix(fading->render(), res, (float)fadePosition / (float)fadeLength);
+        if (++fadePosition >= fadeLength)
+            fading = nullptr;
+        return res;
+    }
+
+private:
+    struct Pool
+    {
+        Drops_v2 drops{0.5f, 0};
+        int used = 0; // one past the highest slot armed
+
+        float render()
+        {
+            float res = 0.0f;
+            for (int k = 0; k < used; ++k)
+                res += drops.drops[k]();
+            return res;
+        }
+    };
+
+    DropTraceReader reader;
+    DropEvent pending;
+    bool opened = false;
+    bool hasPending = false;
+    std::atomic<bool> done{false};
+    double rateRatio = 1.0;
+    juce::int64 position = 0;
+
+    Pool pools[2];
+    Pool *active = &pools[0];
+    Pool *fading = nullptr;
+    int fadeLength = 1;
+    int fadePosition = 0;
+
+    static void silence(Pool &pool)
+    {
+        // silent until the trace arms the slot
+        for (auto &drop : pool.drops.drops)
+            drop.time = drop.t_init + drop.delta_t_3;
+        pool.used = 0;
+    }
+
+    void beginFade(const DropEvent &event)
+    {
+        fading = active;
+        active = active == &pools[0] ? &pools[1] : &pools[0];
+        silence(*active);
+        fadeLength = juce::jmax(1, (int)scaled(event.fadeLength));
+        fadePosition = juce::jlimit(0, fadeLength - 1, (int)scaled(event.fadePosition));
+    }
+
+    juce::int64 scaled(juce::int64 sample) const
+    {
+        return rateRatio == 1.0 ? sample : (juce::int64)std::llround(sample * rateRatio);
+    }
+};
@@ -23,6 +23,8 @@ public:
     float k = 3.0f;
     float m = 6.f;
     float f = 50.0f;
+    // seconds advanced per rendered sample
+    float dt = 1.0f / 44100.0f;
 
     Drop_v2(float t_init = 0.001, float delta_t_1 = 0.002, float delta_t_2 = 0.006, float delta_t_3 = 0.012, float A0 = 1.0, float A1 = 1.20f, float k = 3.0, float m = 6.0, float f = 1500.0)
     {
@@ -57,30 +59,30 @@ public:
 
         if (time < t_init)
         {
-            time += 1.0f / 44100.0f;
+            time += dt;
             return value;
         }
         if (time < (t_init + delta_t_1))
         {
             // t range from -1 to 1
-            time += 1.0f / 44100.0f;
+            time += dt;
             float t = 2 * (time - t_init) / delta_t_1 - 1;
             return A0 * fast_acos(t * t) * 2 / M_PI;
         }
 
         if (time < (t_init + delta_t_2))
         {
-            time += 1.0f / 44100.0f;
+            time += dt;
             return value;
         }
         if (time < (t_init + delta_t_3))
         {
-            time += 1.0f / 44100.0f;
+            time += dt;
             value = exp(-m * (time - t_init - delta_t_2) / (delta_t_3 - delta_t_2)) * A1 * sin(2 * M_PI * f * (time - t_init - delta_t_2));
             return value;
         }
 
-        time += 1.0f / 44100.0f;
+        time += dt;
         return value;
     }
 };
\ No newline at end of file
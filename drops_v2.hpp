@@ -1,3 +1,4 @@
+#pragma once
 #include "utility.hpp"
 #include "drop_v2.hpp"
 
@@ -1,10 +1,13 @@
 #include "drops_v2.hpp"
 #include "plugin_processor.hpp"
+#include "drop_trace.hpp"
+#include "preset_bank.hpp"
+#include "trace_editor.hpp"
 #include <mutex>
 #include <thread>
 
 using namespace juce;
-struct Raindrops : public AudioProcessor
+struct Raindrops : public AudioProcessor, public DropTraceControls
 {
   MonoChain leftChain, rightChain;
   using BlockType = juce::AudioBuffer<float>;
@@ -27,9 +30,27 @@ struct Raindrops : public AudioProcessor
   AudioParameterBool *LPF_enabled;
   AudioParameterFloat *LPF_freq;
 
-  std::unique_ptr<Drops_v2> drops = std::make_unique<Drops_v2>(0.5, 100, 1.0f);
+  // voice pools are built off the audio thread and swapped in by the morph
+  PresetMorph morph{PreparedPreset::prepare(EnginePreset{})};
+  PresetBank bank{morph};
+  std::atomic<int> current_program{0};
+  SmoothedValue<float> gain_smoothed, noise_smoothed;
+  // cut frequencies glide and the enable switches crossfade against the dry signal
+  SmoothedValue<float, ValueSmoothingTypes::Multiplicative> hpf_freq_smoothed, lpf_freq_smoothed;
+  SmoothedValue<float> hpf_amount, lpf_amount;
+  AudioBuffer<float> filter_dry{2, 512};
+  static constexpr int filterStep = 32;
   float running_max = -20.f;
 
+  // one noise draw per sample from a seeded engine, so a trace can replay it
+  std::mt19937 noise_rng{std::random_device{}()};
+  std::uniform_real_distribution<float> noise_dist{-1.f, 1.f};
+
+  // swapped only while holding the callback lock
+  std::unique_ptr<DropTraceWriter> recorder;
+  std::unique_ptr<DropTraceReplay> replay;
+  juce::int64 trace_position = 0;
+
   Raindrops()
       : AudioProcessor(BusesProperties()
                            .withInput("Input", AudioChannelSet::stereo())
@@ -66,7 +87,24 @@ struct Raindrops : public AudioProcessor
   void processBlock(AudioBuffer<float> &buffer, MidiBuffer &) override
   {
 
-    updateFilters();
+    if (morph.beginBlock() && recorder != nullptr)
+      snapshotPools(*recorder, trace_position);
+    // a finished replay hands back to the live engine, the editor picks that up
+    auto *replaying = replay != nullptr && !replay->isDone() ? replay.get() : nullptr;
+    auto &drops = morph.pool();
+    // until a posted pool is swapped in, the one playing keeps its own scheduling
+    float scheduled_density = density->get();
+    float scheduled_freq = freq_coeff->get();
+    float scheduled_interval = single_drop_interval->get();
+    if (morph.isPending())
+    {
+      scheduled_density = morph.preset().density;
+      scheduled_freq = morph.preset().freq_coeff;
+      scheduled_interval = morph.preset().interval_coeff;
+    }
+    const int scheduled = std::min((int)scheduled_density, (int)drops.drops.size());
+    gain_smoothed.setTargetValue(gain->get());
+    noise_smoothed.setTargetValue(noise_level->get());
     auto left = buffer.getWritePointer(0, 0);
     auto right = buffer.getWritePointer(1, 0);
 
@@ -74,11 +112,24 @@ struct Raindrops : public AudioProcessor
     {
 
       float res = 0.0f;
-      res = drops->operator()();
-      for (int k = 0; k < density->get(); ++k)
+      if (replaying != nullptr)
       {
-        if (drops->drops[k].time > 1.012f)
-          drops->drops[k].reset(1.0f, single_drop_interval->get(), freq_coeff->get());
+        // replayed drops are armed by the trace, no scheduling or rng here
+        res = replaying->operator()();
+      }
+      else
+      {
+        res = morph();
+        ++trace_position;
+        for (int k = 0; k < scheduled; ++k)
+        {
+          if (drops.drops[k].time > 1.012f)
+          {
+            drops.drops[k].reset(1.0f, scheduled_interval, scheduled_freq);
+            if (recorder != nullptr)
+              recorder->push(DropEvent::capture(DropEvent::Reset, trace_position, k, drops.drops[k]));
+          }
+        }
       }
 
       if (fabs(res) > fabs(running_max))
@@ -86,22 +137,32 @@ struct Raindrops : public AudioProcessor
         running_max = res;
       }
 
-      float noise = rand_num_new(-1.f, 1.f);
-      left[i] = soft_clip(res * dbtoa(gain->get()) / fabs(running_max) + noise_level->get() * noise);
+      float noise = noise_dist(noise_rng);
+      left[i] = soft_clip(res * dbtoa(gain_smoothed.getNextValue()) / fabs(running_max) + noise_smoothed.getNextValue() * noise);
       right[i] = left[i];
     }
+    if (replaying != nullptr)
+      replaying->updateDone();
 
-    // 1.wrap the buffer with audio block
-    juce::dsp::AudioBlock<float> block(buffer);
-    // 2.extract individual data
-    auto leftBlock = block.getSingleChannelBlock(0);
-    auto rightBlock = block.getSingleChannelBlock(1);
-    // 3.wrap the block to a context which the process chain could use
-    juce::dsp::ProcessContextReplacing<float> leftContext(leftBlock);
-    juce::dsp::ProcessContextReplacing<float> rightContext(rightBlock);
-    // 4.pass the context to filter chains
-    leftChain.process(leftContext);
-    rightChain.process(rightContext);
+    hpf_freq_smoothed.setTargetValue(HPF_freq->get());
+    lpf_freq_smoothed.setTargetValue(LPF_freq->get());
+    hpf_amount.setTargetValue(HPF_enabled->get() ? 1.f : 0.f);
+    lpf_amount.setTargetValue(LPF_enabled->get() ? 1.f : 0.f);
+
+    // chunks the size of the dry buffer, in case the host goes past samplesPerBlock
+    for (int start = 0; start < buffer.getNumSamples(); start += filter_dry.getNumSamples())
+    {
+      const int numSamples = std::min(filter_dry.getNumSamples(), buffer.getNumSamples() - start);
+      // the cut coefficients step every filterStep samples, so a glide does not zipper
+      for (int sub = start; sub < start + numSamples; sub += filterStep)
+      {
+        const int subSamples = std::min(filterStep, start + numSamples - sub);
+        stepFilters(subSamples);
+        processStage<ChainPositions::LowCut>(buffer, sub, subSamples, &hpf_amount);
+        processStage<ChainPositions::Peak>(buffer, sub, subSamples, nullptr);
+        processStage<ChainPositions::HighCut>(buffer, sub, subSamples, &lpf_amount);
+      }
+    }
     // no effects till now since there's no efficient set
     leftChannelFifo.update(buffer);
     rightChannelFifo.update(buffer);
@@ -116,15 +177,32 @@ struct Raindrops : public AudioProcessor
     spec.sampleRate = sampleRate;
     // monoChain so numChannel to be 1
 
+    morph.prepare(sampleRate);
+    gain_smoothed.reset(sampleRate, 0.05);
+    gain_smoothed.setCurrentAndTargetValue(gain->get());
+    noise_smoothed.reset(sampleRate, 0.05);
+    noise_smoothed.setCurrentAndTargetValue(noise_level->get());
+
     leftChain.prepare(spec);
     rightChain.prepare(spec);
     updateFilters();
 
+    hpf_freq_smoothed.reset(sampleRate, 0.05);
+    hpf_freq_smoothed.setCurrentAndTargetValue(HPF_freq->get());
+    lpf_freq_smoothed.reset(sampleRate, 0.05);
+    lpf_freq_smoothed.setCurrentAndTargetValue(LPF_freq->get());
+    hpf_amount.reset(sampleRate, 0.05);
+    hpf_amount.setCurrentAndTargetValue(HPF_enabled->get() ? 1.f : 0.f);
+    lpf_amount.reset(sampleRate, 0.05);
+    lpf_amount.setCurrentAndTargetValue(LPF_enabled->get() ? 1.f : 0.f);
+    filter_dry.setSize(2, jmax(1, samplesPerBlock));
+
     // prepare fifo
     leftChannelFifo.prepare(samplesPerBlock);
     rightChannelFifo.prepare(samplesPerBlock);
   }
 
+  // designs the cut filters from scratch, this allocates so it only runs in prepareToPlay
   void updateFilters()
   {
     auto chainSettings = getChainSettings();
@@ -140,9 +218,6 @@ struct Raindrops : public AudioProcessor
     auto &leftLowCut = leftChain.get<ChainPositions::LowCut>();
     auto &rightLowCut = rightChain.get<ChainPositions::LowCut>();
 
-    leftChain.setBypassed<ChainPositions::LowCut>(chainSettings.lowCutBypassed);
-    rightChain.setBypassed<ChainPositions::LowCut>(chainSettings.lowCutBypassed);
-
     updateCutFilter(leftLowCut, lowCutCoefficients, chainSettings.lowCutSlope);
     updateCutFilter(rightLowCut, lowCutCoefficients, chainSettings.lowCutSlope);
   }
@@ -155,13 +230,59 @@ struct Raindrops : public AudioProcessor
     auto &leftHighCut = leftChain.get<ChainPositions::HighCut>();
     auto &rightHighCut = rightChain.get<ChainPositions::HighCut>();
 
-    leftChain.setBypassed<ChainPositions::HighCut>(chainSettings.highCutBypassed);
-    rightChain.setBypassed<ChainPositions::HighCut>(chainSettings.highCutBypassed);
-
     updateCutFilter(leftHighCut, highCutCoefficients, chainSettings.highCutSlope);
     updateCutFilter(rightHighCut, highCutCoefficients, chainSettings.highCutSlope);
   }
 
+  // moves the cut frequencies along their glide, rewriting the 12 dB/oct stage in place
+  void stepFilters(int numSamples)
+  {
+    if (hpf_freq_smoothed.isSmoothing())
+    {
+      auto freq = hpf_freq_smoothed.skip(numSamples);
+      setCutCoefficientsInPlace(leftChain.get<ChainPositions::LowCut>().get<0>().coefficients, true, freq, getSampleRate());
+      setCutCoefficientsInPlace(rightChain.get<ChainPositions::LowCut>().get<0>().coefficients, true, freq, getSampleRate());
+    }
+    if (lpf_freq_smoothed.isSmoothing())
+    {
+      auto freq = lpf_freq_smoothed.skip(numSamples);
+      setCutCoefficientsInPlace(leftChain.get<ChainPositions::HighCut>().get<0>().coefficients, false, freq, getSampleRate());
+      setCutCoefficientsInPlace(rightChain.get<ChainPositions::HighCut>().get<0>().coefficients, false, freq, getSampleRate());
+    }
+  }
+
+  // runs one chain stage on both channels, mixed against the dry signal by amount
+  template <int Position>
+  void processStage(AudioBuffer<float> &buffer, int start, int numSamples, SmoothedValue<float> *amount)
+  {
+    const bool fullyWet = amount == nullptr || (!amount->isSmoothing() && amount->getTargetValue() == 1.f);
+    if (!fullyWet)
+      for (int ch = 0; ch < 2; ++ch)
+        filter_dry.copyFrom(ch, 0, buffer, ch, start, numSamples);
+
+    juce::dsp::AudioBlock<float> block(buffer);
+    auto leftBlock = block.getSingleChannelBlock(0).getSubBlock((size_t)start, (size_t)numSamples);
+    auto rightBlock = block.getSingleChannelBlock(1).getSubBlock((size_t)start, (size_t)numSamples);
+    juce::dsp::ProcessContextReplacing<float> leftContext(leftBlock);
+    juce::dsp::ProcessContextReplacing<float> rightContext(rightBlock);
+    leftChain.get<Position>().process(leftContext);
+    rightChain.get<Position>().process(rightContext);
+
+    if (fullyWet)
+      return;
+
+    auto left = buffer.getWritePointer(0, start);
+    auto right = buffer.getWritePointer(1, start);
+    auto leftDry = filter_dry.getReadPointer(0);
+    auto rightDry = filter_dry.getReadPointer(1);
+    for (int i = 0; i < numSamples; ++i)
+    {
+      auto wet = amount->getNextValue();
+      left[i] = mix(leftDry[i], left[i], wet);
+      right[i] = mix(rightDry[i], right[i], wet);
+    }
+  }
+
   ChainSettings getChainSettings()
   {
     ChainSettings settings;
@@ -178,31 +299,163 @@ struct Raindrops : public AudioProcessor
   {
   }
 
+  /// drop event traces /////////////////////////////////////////////////////
+  bool startRecording(const File &file) override
+  {
+    stopReplay();
+    stopRecording();
+
+    auto writer = std::make_unique<DropTraceWriter>(file);
+    if (!writer->openedOk())
+      return false;
+
+    DropTraceHeader header;
+    header.sampleRate = getSampleRate();
+    header.noiseSeed = (uint32)Random::getSystemRandom().nextInt();
+    {
+      const ScopedLock sl(getCallbackLock());
+      header.slotCount = (int)PreparedPreset::maxSlots;
+      header.runningMax = running_max;
+      noise_rng.seed(header.noiseSeed);
+      noise_dist.reset();
+      trace_position = 0;
+      snapshotPools(*writer, 0);
+      std::swap(recorder, writer);
+    }
+    recorder->start(header);
+    return true;
+  }
+
+  // captures both sides of a running crossfade, so replay can follow preset switches
+  void snapshotPools(DropTraceWriter &writer, juce::int64 sample)
+  {
+    if (auto *fading = morph.fadingPool())
+    {
+      for (int k = 0; k < (int)fading->drops.size(); ++k)
+        writer.push(DropEvent::capture(DropEvent::Snapshot, sample, k, fading->drops[k]));
+      writer.push(DropEvent::crossfade(sample, morph.getFadeLength(), morph.getFadePosition()));
+    }
+    auto &pool = morph.pool();
+    for (int k = 0; k < (int)pool.drops.size(); ++k)
+      writer.push(DropEvent::capture(DropEvent::Snapshot, sample, k, pool.drops[k]));
+  }
+
+  void stopRecording() override
+  {
+    std::unique_ptr<DropTraceWriter> finished;
+    {
+      const ScopedLock sl(getCallbackLock());
+      std::swap(recorder, finished);
+    }
+    // joins the writer thread and writes the footer outside the lock
+    finished.reset();
+  }
+
+  // rendered at the trace's own rate so the drops come out bit exact; traces
+  // that were cut short or lost records are refused rather than replayed wrong
+  bool startReplay(const File &file) override
+  {
+    stopRecording();
+
+    auto next = std::make_unique<DropTraceReplay>(file);
+    if (!next->openedOk() || !next->isExact())
+      return false;
+
+    {
+      const ScopedLock sl(getCallbackLock());
+      running_max = next->getHeader().runningMax;
+      noise_rng.seed(next->getHeader().noiseSeed);
+      noise_dist.reset();
+      std::swap(replay, next);
+    }
+    return true;
+  }
+
+  void stopReplay() override
+  {
+    std::unique_ptr<DropTraceReplay> finished;
+    {
+      const ScopedLock sl(getCallbackLock());
+      std::swap(replay, finished);
+    }
+  }
+
+  bool isRecording() const override { return recorder != nullptr; }
+  bool isReplaying() const override { return replay != nullptr && !replay->isDone(); }
+
   /// maintaining persistant state on suspend ///////////////////////////////
+  static constexpr int stateMagic = 0x53504452; // "RDPS"
+  static constexpr int stateVersion = 1;
+
+  EnginePreset currentSettings() const
+  {
+    EnginePreset settings;
+    settings.name = bank.get(current_program).name;
+    settings.gain = gain->get();
+    settings.density = density->get();
+    settings.freq_coeff = freq_coeff->get();
+    settings.interval_coeff = single_drop_interval->get();
+    settings.noise_level = noise_level->get();
+    settings.hpf_freq = HPF_freq->get();
+    settings.lpf_freq = LPF_freq->get();
+    settings.hpf_enabled = HPF_enabled->get();
+    settings.lpf_enabled = LPF_enabled->get();
+    return settings;
+  }
+
+  // the parameters jump, the audio thread smooths gain and noise and crossfades the pools
+  void applySettings(const EnginePreset &settings)
+  {
+    *gain = settings.gain;
+    *density = settings.density;
+    *freq_coeff = settings.freq_coeff;
+    *single_drop_interval = settings.interval_coeff;
+    *noise_level = settings.noise_level;
+    *HPF_freq = settings.hpf_freq;
+    *LPF_freq = settings.lpf_freq;
+    *HPF_enabled = settings.hpf_enabled;
+    *LPF_enabled = settings.lpf_enabled;
+  }
+
   void getStateInformation(MemoryBlock &destData) override
   {
-    MemoryOutputStream(destData, true).writeFloat(*gain);
-    MemoryOutputStream(destData, true).writeFloat(*density);
-    MemoryOutputStream(destData, true).writeFloat(*freq_coeff);
-    MemoryOutputStream(destData, true).writeFloat(*single_drop_interval);
-    /// add parameters here /////////////////////////////////////////////////
+    MemoryOutputStream out(destData, false);
+    out.writeInt(stateMagic);
+    out.writeShort((short)stateVersion);
+    currentSettings().write(out);
+    out.writeCompressedInt(current_program);
+    bank.write(out);
+    /// add parameters to EnginePreset //////////////////////////////////////
   }
 
   void setStateInformation(const void *data, int sizeInBytes) override
   {
-    gain->setValueNotifyingHost(
-        MemoryInputStream(data, static_cast<size_t>(sizeInBytes), false)
-            .readFloat());
-    density->setValueNotifyingHost(
-        MemoryInputStream(data, static_cast<size_t>(sizeInBytes), false)
-            .readFloat());
-    freq_coeff->setValueNotifyingHost(
-        MemoryInputStream(data, static_cast<size_t>(sizeInBytes), false)
-            .readFloat());
-    single_drop_interval->setValueNotifyingHost(
-        MemoryInputStream(data, static_cast<size_t>(sizeInBytes), false)
-            .readFloat());
-    /// add parameters here /////////////////////////////////////////////////
+    MemoryInputStream in(data, static_cast<size_t>(sizeInBytes), false);
+    auto settings = currentSettings();
+
+    if (in.readInt() != stateMagic)
+    {
+      // older sessions stored gain, density, freq coeff and interval coeff only
+      in.setPosition(0);
+      if (in.getNumBytesRemaining() < 4 * 4)
+        return;
+      settings.gain = in.readFloat();
+      settings.density = in.readFloat();
+      settings.freq_coeff = in.readFloat();
+      settings.interval_coeff = in.readFloat();
+    }
+    else
+    {
+      if (in.readShort() != stateVersion || !settings.read(in))
+        return;
+      auto program = in.readCompressedInt();
+      if (bank.read(in) && isPositiveAndBelow(program, bank.size()))
+        current_program = program;
+    }
+
+    settings.clampToRanges();
+    bank.morphTo(settings);
+    applySettings(settings);
   }
 
   /// do not change anything below this line, probably //////////////////////
@@ -214,11 +467,21 @@ struct Raindrops : public AudioProcessor
   bool producesMidi() const override { return false; }
 
   /// for handling presets //////////////////////////////////////////////////
-  int getNumPrograms() override { return 1; }
-  int getCurrentProgram() override { return 0; }
-  void setCurrentProgram(int) override {}
-  const String getProgramName(int) override { return "None"; }
-  void changeProgramName(int, const String &) override {}
+  int getNumPrograms() override { return bank.size(); }
+  int getCurrentProgram() override { return current_program; }
+  void setCurrentProgram(int index) override
+  {
+    if (!isPositiveAndBelow(index, bank.size()))
+      return;
+    current_program = index;
+    bank.select(index);
+    applySettings(bank.get(index));
+  }
+  const String getProgramName(int index) override
+  {
+    return isPositiveAndBelow(index, bank.size()) ? bank.get(index).name : String();
+  }
+  void changeProgramName(int index, const String &name) override { bank.rename(index, name); }
 
   /// ?????? ////////////////////////////////////////////////////////////////
   bool isBusesLayoutSupported(const BusesLayout &layouts) const override
@@ -233,7 +496,7 @@ struct Raindrops : public AudioProcessor
   AudioProcessorEditor *createEditor() override
   {
     // return new AudioPluginAudioProcessorEditor(*this);
-    return new GenericAudioProcessorEditor(*this);
+    return new TraceEditor(*this, *this);
   }
   bool hasEditor() const override { return true; }
 
@@ -233,6 +233,25 @@ void updateCutFilter(ChainType &leftLowCut, const CoefficientType &cutCoefficien
     }
 }
 
+// Rewrites a 12 dB/oct cut in place: the same biquad the Butterworth design below
+// gives for order 2, but without allocating a new coefficient set.
+void setCutCoefficientsInPlace(Coefficients &coefficients, bool highPass, float freq, double sampleRate)
+{
+    jassert(coefficients->coefficients.size() == 5);
+    auto n = std::tan(juce::MathConstants<double>::pi * juce::jmin((double)freq, sampleRate * 0.49) / sampleRate);
+    if (!highPass)
+        n = 1.0 / n;
+    auto invQ = juce::MathConstants<double>::sqrt2;
+    auto c1 = 1.0 / (1.0 + invQ * n + n * n);
+
+    auto *raw = coefficients->getRawCoefficients();
+    raw[0] = (float)c1;
+    raw[1] = (float)(highPass ? -2.0 * c1 : 2.0 * c1);
+    raw[2] = (float)c1;
+    raw[3] = (float)(highPass ? c1 * 2.0 * (n * n - 1.0) : c1 * 2.0 * (1.0 - n * n));
+    raw[4] = (float)(c1 * (1.0 - invQ * n + n * n));
+}
+
 auto makeLowCutFilter(const ChainSettings &chainSettings, double sampleRate)
 {
     return juce::dsp::FilterDesign<float>::designIIRHighpassHighOrderButterworthMethod(chainSettings.lowCutFreq, sampleRate, 2 * (chainSettings.lowCutSlope + 1));
@@ -0,0 +1,375 @@
+#pragma once
+#include <juce_core/juce_core.h>
+#include <juce_events/juce_events.h>
+#include <atomic>
+#include "drops_v2.hpp"
+#include "plugin_processor.hpp"
+
+// Full engine state, written as a name, seven floats and a flag byte.
+struct EnginePreset
+{
+    juce::String name = "Default";
+    float gain = -65.f;
+    float density = 10.f;
+    float freq_coeff = 4.0f;
+    float interval_coeff = 1.0f;
+    float noise_level = 0.0f;
+    float hpf_freq = 100.0f;
+    float lpf_freq = 100.0f;
+    bool hpf_enabled = true;
+    bool lpf_enabled = true;
+
+    void write(juce::OutputStream &out) const
+    {
+        out.writeString(name);
+        out.writeFloat(gain);
+        out.writeFloat(density);
+        out.writeFloat(freq_coeff);
+        out.writeFloat(interval_coeff);
+        out.writeFloat(noise_level);
+        out.writeFloat(hpf_freq);
+        out.writeFloat(lpf_freq);
+        out.writeByte((char)((hpf_enabled ? 1 : 0) | (lpf_enabled ? 2 : 0)));
+    }
+
+    bool read(juce::InputStream &in)
+    {
+        name = in.readString();
+        if (in.getNumBytesRemaining() < 7 * 4 + 1)
+            return false;
+
+        gain = in.readFloat();
+        density = in.readFloat();
+        freq_coeff = in.readFloat();
+        interval_coeff = in.readFloat();
+        noise_level = in.readFloat();
+        hpf_freq = in.readFloat();
+        lpf_freq = in.readFloat();
+        auto flags = in.readByte();
+        hpf_enabled = (flags & 1) != 0;
+        lpf_enabled = (flags & 2) != 0;
+        clampToRanges();
+        return true;
+    }
+
+    // keeps restored values inside the parameter ranges, so a corrupt state
+    // cannot ask for an enormous voice pool
+    void clampToRanges()
+    {
+        auto clamp = [](float low, float high, float value)
+        { return std::isfinite(value) ? juce::jlimit(low, high, value) : low; };
+        gain = clamp(-65.f, -1.f, gain);
+        density = clamp(1.f, 400.f, density);
+        freq_coeff = clamp(0.1f, 4.0f, freq_coeff);
+        interval_coeff = clamp(0.1f, 4.0f, interval_coeff);
+        noise_level = clamp(0.0f, 0.01f, noise_level);
+        hpf_freq = clamp(1000.f, 20000.0f, hpf_freq);
+        lpf_freq = clamp(100.f, 20000.0f, lpf_freq);
+    }
+};
+
+// A voice pool built ahead of time on the message thread, ready to be handed to
+// the audio thread without any allocation there.
+struct PreparedPreset
+{
+    // the top of the density range, every pool is built this large
+    static constexpr uint maxSlots = 400;
+
+    std::unique_ptr<Drops_v2> pool;
+    // what the pool is scheduled with, kept so it can go on using them while
+    // the parameters already hold the next preset's
+    float density = 10.f;
+    float freq_coeff = 4.0f;
+    float interval_coeff = 1.0f;
+
+    static std::unique_ptr<PreparedPreset> prepare(const EnginePreset &settings)
+    {
+        auto prepared = std::make_unique<PreparedPreset>();
+        prepared->density = settings.density;
+        prepared->freq_coeff = settings.freq_coeff;
+        prepared->interval_coeff = settings.interval_coeff;
+
+        // every pool holds the full density range, so the knob can turn up
+        // without a new pool; slots above the density start idle and are only
+        // scheduled once the density reaches them
+        auto active = (uint)juce::jlimit(1.f, (float)maxSlots, settings.density);
+        prepared->pool = std::make_unique<Drops_v2>(settings.freq_coeff, maxSlots, 1.0f, settings.interval_coeff);
+
+        for (auto k = active; k < maxSlots; ++k)
+            prepared->pool->drops[k].time = 2.f;
+        return prepared;
+    }
+};
+
+// Owns the voice pools the audio thread renders and crossfades between them.
+// The message thread posts a prepared pool with an atomic pointer swap; pools
+// that finish fading out come back through a fifo and are freed by the bank.
+class PresetMorph
+{
+public:
+    explicit PresetMorph(std::unique_ptr<PreparedPreset> initial) : active(initial.release())
+    {
+    }
+
+    ~PresetMorph()
+    {
+        delete active;
+        delete fading;
+        delete retiring;
+        delete pending.exchange(nullptr);
+        PreparedPreset *retired = nullptr;
+        while (retiredFifo.pull(retired))
+            delete retired;
+    }
+
+    /// message thread ////////////////////////////////////////////////////////
+    void post(std::unique_ptr<PreparedPreset> next)
+    {
+        // a pool the audio thread never picked up is still ours to free
+        delete pending.exchange(next.release());
+        expected.store(false);
+    }
+
+    // a pool is on its way but not built yet, see isPending()
+    void expect()
+    {
+        expected.store(true);
+    }
+
+    std::unique_ptr<PreparedPreset> pullRetired()
+    {
+        PreparedPreset *retired = nullptr;
+        if (retiredFifo.pull(retired))
+            return std::unique_ptr<PreparedPreset>(retired);
+        return nullptr;
+    }
+
+    /// audio thread //////////////////////////////////////////////////////////
+    void prepare(double sampleRate)
+    {
+        fadeLength = juce::jmax(1, juce::roundToInt(sampleRate * 0.05));
+        dt = (float)(1.0 / sampleRate);
+        setClock(active);
+        setClock(fading);
+    }
+
+    // picks up a posted pool, once the previous fade has been handed back;
+    // true when a new crossfade starts this block
+    bool beginBlock()
+    {
+        if (retiring != nullptr && retiredFifo.push(retiring))
+            retiring = nullptr;
+        if (retiring != nullptr || fading != nullptr)
+            return false;
+
+        if (auto *next = pending.exchange(nullptr))
+        {
+            // pools are built without knowing the host rate
+            setClock(next);
+            fading = active;
+            active = next;
+            fadePosition = 0;
+            return true;
+        }
+        return false;
+    }
+
+    // the pool new drops are scheduled on; a fading pool only rings out
+    Drops_v2 &pool()
+    {
+        return *active->pool;
+    }
+
+    // the preset behind pool(), with the settings it was prepared for
+    const PreparedPreset &preset() const
+    {
+        return *active;
+    }
+
+    // true from expect() or post() until the audio thread swaps the pool in;
+    // meanwhile the parameters already belong to the next preset, not the one playing
+    bool isPending() const
+    {
+        return expected.load() || pending.load() != nullptr;
+    }
+
+    // the pool ringing out, or nullptr when no crossfade is running
+    Drops_v2 *fadingPool()
+    {
+        return fading != nullptr ? fading->pool.get() : nullptr;
+    }
+
+    int getFadeLength() const
+    {
+        return fadeLength;
+    }
+
+    int getFadePosition() const
+    {
+        return fadePosition;
+    }
+
+    float operator()()
+    {
+        float res = active->pool->operator()();
+        if (fading == nullptr)
+            return res;
+
+        res = mix(fading->pool->operator()(), res, (float)fadePosition / (float)fadeLength);
+        if (++fadePosition >= fadeLength)
+        {
+            retiring = fading;
+            fading = nullptr;
+        }
+        return res;
+    }
+
+private:
+    PreparedPreset *active = nullptr;
+    PreparedPreset *fading = nullptr;
+    PreparedPreset *retiring = nullptr;
+    std::atomic<PreparedPreset *> pending{nullptr};
+    std::atomic<bool> expected{false};
+    Fifo<PreparedPreset *> retiredFifo;
+    int fadeLength = 2205;
+    int fadePosition = 0;
+    float dt = 1.0f / 44100.0f;
+
+    void setClock(PreparedPreset *preset)
+    {
+        if (preset == nullptr)
+            return;
+        for (auto &drop : preset->pool->drops)
+            drop.dt = dt;
+    }
+};
+
+// Named presets with a voice pool kept prepared for each, so selecting one only
+// posts a pointer. Hosts may call in from any thread but the audio thread, so
+// the bank's own lock guards it; the audio thread only ever sees PresetMorph.
+class PresetBank : private juce::Timer
+{
+public:
+    explicit PresetBank(PresetMorph &presetMorph) : morph(presetMorph)
+    {
+        presets.push_back(EnginePreset{});
+        presets.push_back(EnginePreset{"Drizzle", -24.f, 8.f, 4.0f, 0.6f, 0.001f, 1000.f, 20000.f, true, false});
+        presets.push_back(EnginePreset{"Light Rain", -20.f, 40.f, 3.0f, 1.0f, 0.002f, 1000.f, 20000.f, true, false});
+        presets.push_back(EnginePreset{"Steady Rain", -16.f, 120.f, 2.5f, 1.2f, 0.004f, 1000.f, 20000.f, false, false});
+        presets.push_back(EnginePreset{"Downpour", -12.f, 400.f, 2.0f, 1.5f, 0.008f, 1000.f, 12000.f, false, true});
+        prepared = prepareAll(presets);
+        startTimerHz(10);
+    }
+
+    int size() const
+    {
+        const juce::ScopedLock sl(lock);
+        return (int)presets.size();
+    }
+
+    // a copy, the bank may be replaced by another thread meanwhile
+    EnginePreset get(int index) const
+    {
+        const juce::ScopedLock sl(lock);
+        return juce::isPositiveAndBelow(index, (int)presets.size()) ? presets[(size_t)index] : EnginePreset{};
+    }
+
+    void rename(int index, const juce::String &name)
+    {
+        const juce::ScopedLock sl(lock);
+        if (juce::isPositiveAndBelow(index, (int)presets.size()))
+            presets[(size_t)index].name = name;
+    }
+
+    // morphs to a bank preset, using the pool prepared for it
+    void select(int index)
+    {
+        const juce::ScopedLock sl(lock);
+        if (!juce::isPositiveAndBelow(index, (int)presets.size()))
+            return;
+
+        auto next = std::move(prepared[(size_t)index]);
+        if (next == nullptr && !juce::MessageManager::existsAndIsCurrentThread())
+        {
+            // selected again before the timer refilled it: let the timer build
+            // the pool rather than whichever host thread called in
+            deferred = index;
+            morph.expect();
+            return;
+        }
+        if (next == nullptr)
+            next = PreparedPreset::prepare(presets[(size_t)index]);
+        deferred = -1;
+        morph.post(std::move(next));
+    }
+
+    // morphs to settings that are not in the bank, e.g. restored state
+    void morphTo(const EnginePreset &settings)
+    {
+        {
+            const juce::ScopedLock sl(lock);
+            deferred = -1;
+        }
+        morph.post(PreparedPreset::prepare(settings));
+    }
+
+    void write(juce::OutputStream &out) const
+    {
+        const juce::ScopedLock sl(lock);
+        out.writeCompressedInt((int)presets.size());
+        for (auto &preset : presets)
+            preset.write(out);
+    }
+
+    bool read(juce::InputStream &in)
+    {
+        auto count = in.readCompressedInt();
+        if (count <= 0 || count > 128)
+            return false;
+
+        std::vector<EnginePreset> loaded((size_t)count);
+        for (auto &preset : loaded)
+            if (!preset.read(in))
+                return false;
+
+        // built before taking the lock, so the timer is not held up meanwhile
+        auto pools = prepareAll(loaded);
+        const juce::ScopedLock sl(lock);
+        presets = std::move(loaded);
+        prepared = std::move(pools);
+        deferred = -1;
+        return true;
+    }
+
+private:
+    PresetMorph &morph;
+    juce::CriticalSection lock;
+    std::vector<EnginePreset> presets;
+    std::vector<std::unique_ptr<PreparedPreset>> prepared;
+    int deferred = -1;
+
+    static std::vector<std::unique_ptr<PreparedPreset>> prepareAll(const std::vector<EnginePreset> &settings)
+    {
+        std::vector<std::unique_ptr<PreparedPreset>> pools;
+        for (auto &preset : settings)
+            pools.push_back(PreparedPreset::prepare(preset));
+        return pools;
+    }
+
+    void timerCallback() override
+    {
+        // faded out pools are freed here rather than on the audio thread
+        while (morph.pullRetired() != nullptr)
+        {
+        }
+
+        const juce::ScopedLock sl(lock);
+        if (deferred >= 0)
+            select(deferred);
+
+        // keep a pool ready for every preset that was selected since the last tick
+        for (size_t i = 0; i < presets.size(); ++i)
+            if (prepared[i] == nullptr)
+                prepared[i] = PreparedPreset::prepare(presets[i]);
+    }
+};
@@ -0,0 +1,109 @@
+#pragma once
+#include <juce_audio_processors/juce_audio_processors.h>
+#include <juce_gui_basics/juce_gui_basics.h>
+
+// What the editor needs from the processor to record and replay drop traces.
+struct DropTraceControls
+{
+    virtual ~DropTraceControls() = default;
+    virtual bool startRecording(const juce::File &file) = 0;
+    virtual void stopRecording() = 0;
+    virtual bool startReplay(const juce::File &file) = 0;
+    virtual void stopReplay() = 0;
+    virtual bool isRecording() const = 0;
+    virtual bool isReplaying() const = 0;
+};
+
+// The generic parameter editor with a row of trace buttons underneath.
+class TraceEditor : public juce::AudioProcessorEditor, private juce::Timer
+{
+public:
+    TraceEditor(juce::AudioProcessor &audioProcessor, DropTraceControls &traceControls)
+        : AudioProcessorEditor(audioProcessor), controls(traceControls), parameters(audioProcessor)
+    {
+        addAndMakeVisible(parameters);
+        addAndMakeVisible(recordButton);
+        addAndMakeVisible(replayButton);
+        recordButton.onClick = [this]
+        { toggleRecording(); };
+        replayButton.onClick = [this]
+        { toggleReplay(); };
+        updateButtons();
+        setSize(parameters.getWidth(), parameters.getHeight() + buttonRowHeight);
+        // a replay ends on its own once the trace has rung out
+        startTimerHz(4);
+    }
+
+    void resized() override
+    {
+        auto area = getLocalBounds();
+        auto row = area.removeFromBottom(buttonRowHeight).reduced(4);
+        recordButton.setBounds(row.removeFromLeft(row.getWidth() / 2).reduced(2, 0));
+        replayButton.setBounds(row.reduced(2, 0));
+        parameters.setBounds(area);
+    }
+
+private:
+    static constexpr int buttonRowHeight = 36;
+    DropTraceControls &controls;
+    juce::GenericAudioProcessorEditor parameters;
+    juce::TextButton recordButton, replayButton;
+    std::unique_ptr<juce::FileChooser> chooser;
+
+    static juce::File defaultTraceFile()
+    {
+        return juce::File::getSpecialLocation(juce::File::userDocumentsDirectory).getChildFile("drops.rdtr");
+    }
+
+    void toggleRecording()
+    {
+        if (controls.isRecording())
+        {
+            controls.stopRecording();
+            updateButtons();
+            return;
+        }
+
+        chooser = std::make_unique<juce::FileChooser>("Record drop trace", defaultTraceFile(), "*.rdtr");
+        auto flags = juce::FileBrowserComponent::saveMode | juce::FileBrowserComponent::canSelectFiles | juce::FileBrowserComponent::warnAboutOverwriting;
+        chooser->launchAsync(flags, [this](const juce::FileChooser &fc)
+                             {
+                                 if (fc.getResult() != juce::File() && !controls.startRecording(fc.getResult()))
+                                     showError("Record Trace", "The trace file could not be opened for writing.");
+                                 updateButtons(); });
+    }
+
+    void toggleReplay()
+    {
+        if (controls.isReplaying())
+        {
+            controls.stopReplay();
+            updateButtons();
+            return;
+        }
+
+        chooser = std::make_unique<juce::FileChooser>("Replay drop trace", defaultTraceFile(), "*.rdtr");
+        auto flags = juce::FileBrowserComponent::openMode | juce::FileBrowserComponent::canSelectFiles;
+        chooser->launchAsync(flags, [this](const juce::FileChooser &fc)
+                             {
+                                 if (fc.getResult() != juce::File() && !controls.startReplay(fc.getResult()))
+                                     showError("Replay Trace", "The trace is unreadable, was cut short, or lost records while recording, so it cannot be replayed exactly.");
+                                 updateButtons(); });
+    }
+
+    static void showError(const juce::String &title, const juce::String &message)
+    {
+        juce::AlertWindow::showMessageBoxAsync(juce::AlertWindow::WarningIcon, title, message);
+    }
+
+    void timerCallback() override
+    {
+        updateButtons();
+    }
+
+    void updateButtons()
+    {
+        recordButton.setButtonText(controls.isRecording() ? "Stop Recording" : "Record Trace");
+        replayButton.setButtonText(controls.isReplaying() ? "Stop Replay" : "Replay Trace");
+    }
+};